@@ -5,6 +5,8 @@
 #include <sys/printk.h>
 #include <zephyr.h>
 
+#include "energy.h"
+#include "link_policy.h"
 #include "stdint.h"
 #include "stdlib.h"
 #include "string.h"
@@ -45,6 +47,81 @@
  */
 #define BT_UART_WRITE_CHAR_UUID BT_UUID_DECLARE_16(BT_UART_WRITE_CHAR_UUID_VAL)
 
+/**
+ * @brief Size of each payload buffer: the largest payload plus the string terminator,
+ * rounded up to the slab alignment.
+ *
+ */
+#define PAYLOAD_BUF_SIZE ROUND_UP(CONFIG_APP_PAYLOAD_BUF_SIZE + 1, 4)
+
+/**
+ * @brief Console command that prints the peak stack usage of every thread.
+ *
+ */
+#define STACK_REPORT_CMD "threads"
+
+/**
+ * @brief Echo writes waiting for their notification. The peripheral echoes the writes
+ * in order, so each notification is matched to the oldest pending write.
+ *
+ */
+#define ECHO_PENDING_MAX 8
+
+#if defined(BLE_PARAMS_TUNED)
+/**
+ * @brief Scan interval and window, in units of 0.625 ms. The tuned profile scans for
+ * 260 ms every 1.28 s instead of half of the time. The window covers one advertising
+ * interval of the tuned peripheral, so discovery takes at most one scan interval.
+ *
+ */
+#define SCAN_INTERVAL BT_GAP_SCAN_SLOW_INTERVAL_1
+#define SCAN_WINDOW   (ENERGY_TUNED_ADV_INT_MAX + ENERGY_ADV_EVENT)
+
+/**
+ * @brief Connection parameters. The tuned profile uses a 100-200 ms interval and lets
+ * the peripheral skip up to 4 idle connection events.
+ *
+ */
+#define CONN_PARAM BT_LE_CONN_PARAM(80, 160, 4, 400)
+#else
+/**
+ * @brief Scan interval and window, in units of 0.625 ms.
+ *
+ */
+#define SCAN_INTERVAL BT_GAP_SCAN_FAST_INTERVAL
+#define SCAN_WINDOW   BT_GAP_SCAN_FAST_WINDOW
+
+/**
+ * @brief Connection parameters.
+ *
+ */
+#define CONN_PARAM BT_LE_CONN_PARAM_DEFAULT
+#endif
+
+/**
+ * @brief Candidate window, in ms. Spans at least CANDIDATE_WINDOW_SCANS scan intervals
+ * so that every advertiser in range is heard, even with the 1.28 s tuned scan interval.
+ *
+ */
+#define CANDIDATE_WINDOW_SCANS 3
+#define CANDIDATE_WINDOW_MS                                                              \
+    MAX(CONFIG_APP_CANDIDATE_WINDOW_MS, CANDIDATE_WINDOW_SCANS * SCAN_INTERVAL * 5 / 8)
+
+/** @brief Echo writes waiting for their notification, oldest first. */
+struct echo_queue {
+    uint32_t sent_ms[ECHO_PENDING_MAX];
+    size_t head;
+    size_t count;
+    uint32_t rtt_sum_ms;
+    uint32_t echoes;
+};
+
+/** @brief Advertising report passed to found_service_handler(). */
+struct scan_report {
+    const bt_addr_le_t *addr;
+    int8_t rssi;
+};
+
 /**
  * @brief Callback function for when the MTU (Maximum Transmission Unit) is updated.
  * @param conn The Bluetooth connection.
@@ -58,9 +135,9 @@ void mtu_updated(struct bt_conn *conn, uint16_t tx, uint16_t rx);
 /**
 * @brief Callback function to handle the service discovery results.
 * @param data Pointer to a structure containing information about the scanned BLE service.
-* @param user_data Pointer to user-specific data passed to this function.
+* @param user_data Pointer to the struct scan_report of the advertiser.
 * @return true if the service is not of interest or if the service data is invalid.
-* @return false if the service is of interest and the connection attempt was initiated.
+* @return false if the service is of interest and the advertiser became a candidate.
 */
 static bool found_service_handler(struct bt_data *data, void *user_data);
 
@@ -74,6 +151,28 @@ static bool found_service_handler(struct bt_data *data, void *user_data);
 static void found_device_handler(const bt_addr_le_t *device_address, int8_t rssi,
                                  uint8_t type, struct net_buf_simple *advertising_data);
 
+/**
+ * @brief Adds an advertiser of the UART service to the candidate list and opens the
+ * candidate window on the first one.
+ * @param addr Address of the advertiser.
+ * @param rssi RSSI of the advertising report.
+ */
+static void candidate_found(const bt_addr_le_t *addr, int8_t rssi);
+
+/**
+ * @brief Timer callback closing the candidate window.
+ * @param timer The candidate window timer.
+ */
+static void candidate_window_expired(struct k_timer *timer);
+
+/**
+ * @brief Stops scanning and connects to the candidate with the strongest smoothed RSSI,
+ * falling back to the next one if the connection cannot be created. Also submitted by
+ * connected() when a connection attempt fails, to try the next candidate.
+ * @param work The connect work item.
+ */
+static void connect_best_candidate(struct k_work *work);
+
 /**
  * @brief Starts a BLE scan with the specified scan parameters and callback function for
  * discovered devices.
@@ -124,6 +223,68 @@ static void connected(struct bt_conn *connection, uint8_t error);
 */
 static void disconnected(struct bt_conn *conn, uint8_t reason);
 
+/**
+ * @brief Callback function called when the connection parameters are updated.
+ * @param conn The connection object.
+ * @param interval The new connection interval, in units of 1.25 ms.
+ * @param latency The new slave latency.
+ * @param timeout The new supervision timeout, in units of 10 ms.
+ * @return None.
+ */
+static void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency,
+                             uint16_t timeout);
+
+/**
+ * @brief Callback function called when the PHY of the connection is updated.
+ * @param conn The connection object.
+ * @param param The new TX and RX PHY.
+ * @return None.
+ */
+static void le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param);
+
+/**
+ * @brief Reads the RSSI of a connection from the controller.
+ * @param conn The connection object.
+ * @param rssi Pointer to store the RSSI, in dBm.
+ * @return 0 on success, otherwise a negative error code.
+ */
+static int read_conn_rssi(struct bt_conn *conn, int8_t *rssi);
+
+/**
+ * @brief Requests a PHY update of a connection.
+ * @param conn The connection object.
+ * @param phy LINK_PHY_1M, LINK_PHY_2M or LINK_PHY_CODED.
+ * @return None.
+ */
+static void request_phy(struct bt_conn *conn, uint8_t phy);
+
+/**
+ * @brief Records the send time of an echo write.
+ * @return None.
+ */
+static void echo_write_sent(void);
+
+/**
+ * @brief Matches a notification to the oldest pending echo write and adds its round-trip
+ * time to the current period. Writes pending for longer than a period count as lost.
+ * @return None.
+ */
+static void echo_received(void);
+
+/**
+ * @brief Timer callback scheduling a link quality evaluation.
+ * @param timer The link quality timer.
+ */
+static void link_quality_timer_expired(struct k_timer *timer);
+
+/**
+ * @brief Measures RSSI, echo round-trip time and goodput of the last period and
+ * switches the PHY when the link policy asks for it. Connection and PHY updates from
+ * the BT RX thread reach phy_policy through link_restart and phy_updated.
+ * @param work The link quality work item.
+ */
+static void link_quality_handler(struct k_work *work);
+
 /**
  * @brief Task to handle user input and send it to the BLE central device via GATT.
  * @return void.
@@ -146,12 +307,63 @@ static struct bt_gatt_cb gatt_cb = {
 
 /** @brief Bluetooth connection callback object */
 struct bt_conn_cb conn_cb = {
-    .connected    = connected,
-    .disconnected = disconnected,
+    .connected        = connected,
+    .disconnected     = disconnected,
+    .le_param_updated = le_param_updated,
+    .le_phy_updated   = le_phy_updated,
 };
 
 /** @brief Thread object to handle user input */
-K_THREAD_DEFINE(input, 1024, input_task, NULL, NULL, NULL, 1, 0, 1000);
+K_THREAD_DEFINE(input, CONFIG_APP_INPUT_STACK_SIZE, input_task, NULL, NULL, NULL, 1, 0,
+                1000);
+
+/** @brief Static pool of buffers for received GATT payloads */
+K_MEM_SLAB_DEFINE(payload_slab, PAYLOAD_BUF_SIZE, CONFIG_APP_PAYLOAD_BUF_COUNT, 4);
+
+/** @brief Advertisers of the UART service seen during the candidate window */
+static struct link_candidates candidates;
+
+/** @brief Lock of the candidate list, shared by the scan callback and the connect work */
+K_MUTEX_DEFINE(candidates_lock);
+
+/** @brief Whether the candidate window is open or its connection attempt is pending */
+static bool selecting = false;
+
+/** @brief Timer closing the candidate window */
+K_TIMER_DEFINE(candidate_timer, candidate_window_expired, NULL);
+
+/** @brief Work item connecting to the best candidate */
+K_WORK_DEFINE(connect_work, connect_best_candidate);
+
+/** @brief PHY selection state of the default connection, only used by the link quality
+ * work */
+static struct link_policy phy_policy;
+
+/** @brief Set by connected() to restart phy_policy for a new connection */
+static atomic_t link_restart;
+
+/** @brief TX PHY of the last PHY update not yet applied to phy_policy, or 0 */
+static atomic_t phy_updated;
+
+/** @brief Timer scheduling the periodic link quality evaluation */
+K_TIMER_DEFINE(link_quality_timer, link_quality_timer_expired, NULL);
+
+/** @brief Work item evaluating the link quality */
+K_WORK_DEFINE(link_quality_work, link_quality_handler);
+
+/** @brief Pending echo writes and round-trip times of the current period */
+static struct echo_queue pending_echoes;
+
+/** @brief Lock of the echo queue, shared by the input thread, the BT RX thread and the
+ * link quality work */
+static struct k_spinlock pending_echoes_lock;
+
+/** @brief Echoed bytes in the current period */
+static atomic_t echo_bytes;
+
+/** @brief Connection interval (low 16 bits, in units of 1.25 ms) and peripheral latency
+ * (high 16 bits) of the default connection, updated together */
+static atomic_t conn_params;
 
 /** @brief Bluetooth GATT discover parameters */
 static struct bt_gatt_discover_params discover_params = {0};
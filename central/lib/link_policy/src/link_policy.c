@@ -0,0 +1,283 @@
+#include "link_policy.h"
+
+#include <string.h>
+
+/** @brief L2CAP (4 bytes) plus ATT opcode and handle (3 bytes) added to every payload. */
+#define ATT_OVERHEAD 7U
+
+/** @brief Inter frame space between two packets of the same exchange, in us. */
+#define T_IFS_US 150U
+
+/** @brief Inverse weight of a new sample in the smoothed RSSI (1/4). */
+#define RSSI_SMOOTHING 4
+
+static int16_t smooth(int16_t rssi_x16, int8_t rssi)
+{
+    return rssi_x16 + ((rssi * 16 - rssi_x16) / RSSI_SMOOTHING);
+}
+
+static uint32_t airtime_us(uint8_t phy, size_t pdu_len)
+{
+    switch (phy) {
+    case LINK_PHY_2M:
+        return (11U + pdu_len) * 4U;
+    case LINK_PHY_CODED:
+        return 400U + (5U + pdu_len) * 64U;
+    default:
+        return (10U + pdu_len) * 8U;
+    }
+}
+
+/* Packet error rate implied by the echo round-trip time: every retransmission of the
+ * write or of its notification delays the echo by one connection interval. */
+static uint32_t rtt_per(struct link_policy *policy, const struct link_period *period)
+{
+    /* A write can wait up to latency + 1 events for the peripheral to listen. */
+    uint32_t slack_us = (policy->latency + 1U) * policy->interval_us;
+    uint32_t rtt_us;
+    uint32_t extra_us;
+
+    if (!period->echoes || !policy->interval_us) {
+        return 0;
+    }
+
+    rtt_us = period->rtt_sum_us / period->echoes;
+    if (!policy->rtt_base_us || rtt_us < policy->rtt_base_us) {
+        policy->rtt_base_us = rtt_us;
+    }
+
+    if (rtt_us <= policy->rtt_base_us + slack_us) {
+        return 0;
+    }
+
+    /* Two packets per echo: extra = 2 * PER / (1 - PER) intervals. */
+    extra_us = rtt_us - policy->rtt_base_us - slack_us;
+    return (uint32_t) ((uint64_t) extra_us * 100U / (extra_us + 2U * policy->interval_us));
+}
+
+static uint32_t expected_goodput(const struct link_policy *policy, uint8_t phy,
+                                 uint32_t per_pct)
+{
+    return link_policy_goodput(phy, LINK_POLICY_PAYLOAD_LEN, policy->interval_us, per_pct);
+}
+
+void link_candidates_reset(struct link_candidates *list)
+{
+    memset(list, 0, sizeof(*list));
+}
+
+int link_candidates_add(struct link_candidates *list, const uint8_t *addr, int8_t rssi)
+{
+    struct link_candidate *candidate;
+
+    for (size_t i = 0; i < list->count; i++) {
+        candidate = &list->items[i];
+        if (!memcmp(candidate->addr, addr, LINK_POLICY_ADDR_LEN)) {
+            candidate->rssi_x16 = smooth(candidate->rssi_x16, rssi);
+            candidate->samples++;
+            return 0;
+        }
+    }
+
+    if (list->count == LINK_POLICY_MAX_CANDIDATES) {
+        return -1;
+    }
+
+    candidate = &list->items[list->count++];
+    memcpy(candidate->addr, addr, LINK_POLICY_ADDR_LEN);
+    candidate->rssi_x16 = rssi * 16;
+    candidate->samples  = 1;
+
+    return 0;
+}
+
+void link_candidates_remove(struct link_candidates *list, const uint8_t *addr)
+{
+    for (size_t i = 0; i < list->count; i++) {
+        if (!memcmp(list->items[i].addr, addr, LINK_POLICY_ADDR_LEN)) {
+            list->items[i] = list->items[--list->count];
+            return;
+        }
+    }
+}
+
+const struct link_candidate *link_candidates_best(const struct link_candidates *list)
+{
+    const struct link_candidate *best = NULL;
+
+    for (size_t i = 0; i < list->count; i++) {
+        if (!best || list->items[i].rssi_x16 > best->rssi_x16) {
+            best = &list->items[i];
+        }
+    }
+
+    return best;
+}
+
+int8_t link_candidate_rssi(const struct link_candidate *candidate)
+{
+    return candidate->rssi_x16 / 16;
+}
+
+void link_policy_reset(struct link_policy *policy, uint8_t phy, uint32_t interval_us,
+                       uint16_t latency)
+{
+    memset(policy, 0, sizeof(*policy));
+    policy->phy         = phy;
+    policy->interval_us = interval_us;
+    policy->latency     = latency;
+    policy->target      = phy;
+}
+
+void link_policy_set_conn_params(struct link_policy *policy, uint32_t interval_us,
+                                 uint16_t latency)
+{
+    if (interval_us != policy->interval_us || latency != policy->latency) {
+        policy->interval_us = interval_us;
+        policy->latency     = latency;
+        policy->rtt_base_us = 0;
+    }
+}
+
+void link_policy_set_phy(struct link_policy *policy, uint8_t phy)
+{
+    policy->phy         = phy;
+    policy->target      = phy;
+    policy->votes       = 0;
+    policy->rtt_base_us = 0;
+}
+
+uint8_t link_policy_evaluate(struct link_policy *policy, const struct link_period *period)
+{
+    static const uint8_t neighbours[][2] = {
+        [LINK_PHY_1M]    = {LINK_PHY_2M, LINK_PHY_CODED},
+        [LINK_PHY_2M]    = {LINK_PHY_1M, LINK_PHY_1M},
+        [LINK_PHY_CODED] = {LINK_PHY_1M, LINK_PHY_1M},
+    };
+    uint32_t measured;
+    uint32_t current;
+    uint32_t best_goodput;
+    uint8_t best;
+    int8_t rssi;
+
+    measured = rtt_per(policy, period);
+
+    if (period->has_rssi) {
+        policy->rssi_x16 =
+            policy->has_rssi ? smooth(policy->rssi_x16, period->rssi) : period->rssi * 16;
+        policy->has_rssi = true;
+    }
+
+    if (!policy->has_rssi || policy->phy > LINK_PHY_CODED || !neighbours[policy->phy][0]) {
+        return policy->phy;
+    }
+    /* The smoothed RSSI lags a fading link: estimate from the worse of the two so the
+     * policy never moves to a PHY the last period could not sustain. */
+    rssi = link_policy_rssi(policy);
+    if (period->has_rssi && period->rssi < rssi) {
+        rssi = period->rssi;
+    }
+
+    current = link_policy_per(policy->phy, rssi);
+    if (measured > current) {
+        current = measured;
+    }
+    current = expected_goodput(policy, policy->phy, current);
+
+    best         = policy->phy;
+    best_goodput = current;
+    for (size_t i = 0; i < 2; i++) {
+        uint8_t phy      = neighbours[policy->phy][i];
+        uint32_t goodput = expected_goodput(policy, phy, link_policy_per(phy, rssi));
+
+        if (goodput > best_goodput) {
+            best         = phy;
+            best_goodput = goodput;
+        }
+    }
+
+    if (best == policy->phy
+        || (uint64_t) best_goodput * 100U <= (uint64_t) current * (100U + LINK_POLICY_GAIN)) {
+        policy->target = policy->phy;
+        policy->votes  = 0;
+        return policy->phy;
+    }
+
+    if (best != policy->target) {
+        policy->target = best;
+        policy->votes  = 0;
+    }
+
+    if (++policy->votes < LINK_POLICY_STABLE_PERIODS) {
+        return policy->phy;
+    }
+
+    policy->votes = 0;
+    return best;
+}
+
+int8_t link_policy_rssi(const struct link_policy *policy)
+{
+    return policy->rssi_x16 / 16;
+}
+
+uint32_t link_policy_per(uint8_t phy, int8_t rssi)
+{
+    int sensitivity;
+    int margin;
+
+    switch (phy) {
+    case LINK_PHY_2M:
+        sensitivity = LINK_POLICY_SENSITIVITY_2M;
+        break;
+    case LINK_PHY_CODED:
+        sensitivity = LINK_POLICY_SENSITIVITY_CODED;
+        break;
+    default:
+        sensitivity = LINK_POLICY_SENSITIVITY_1M;
+        break;
+    }
+
+    margin = rssi - sensitivity;
+    if (margin <= 0) {
+        return 100U;
+    }
+    if (margin >= LINK_POLICY_PER_MARGIN) {
+        return LINK_POLICY_PER_FLOOR;
+    }
+
+    return LINK_POLICY_PER_FLOOR
+           + (100U - LINK_POLICY_PER_FLOOR) * (uint32_t) (LINK_POLICY_PER_MARGIN - margin)
+                 / LINK_POLICY_PER_MARGIN;
+}
+
+uint32_t link_policy_goodput(uint8_t phy, size_t payload_len, uint32_t interval_us,
+                             uint32_t per_pct)
+{
+    uint32_t exchange_us = airtime_us(phy, payload_len + ATT_OVERHEAD) + T_IFS_US
+                           + airtime_us(phy, 0) + T_IFS_US;
+    uint32_t packets     = interval_us / exchange_us;
+
+    if (!interval_us || per_pct >= 100U) {
+        return 0;
+    }
+
+    if (!packets) {
+        packets = 1;
+    }
+
+    return (uint32_t) ((uint64_t) payload_len * packets * (100U - per_pct) * 10000U
+                       / interval_us);
+}
+
+const char *link_phy_str(uint8_t phy)
+{
+    switch (phy) {
+    case LINK_PHY_2M:
+        return "2M";
+    case LINK_PHY_CODED:
+        return "Coded";
+    default:
+        return "1M";
+    }
+}
@@ -0,0 +1,217 @@
+#ifndef LINK_POLICY_H_
+#define LINK_POLICY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Maximum number of advertisers ranked during one candidate window.
+ *
+ */
+#ifndef LINK_POLICY_MAX_CANDIDATES
+#define LINK_POLICY_MAX_CANDIDATES 8
+#endif
+
+/**
+ * @brief Size of a Bluetooth LE address (type followed by the 6 address bytes).
+ *
+ */
+#define LINK_POLICY_ADDR_LEN 7
+
+/**
+ * @brief PHY values, matching BT_GAP_LE_PHY_1M, BT_GAP_LE_PHY_2M and
+ * BT_GAP_LE_PHY_CODED.
+ *
+ */
+#define LINK_PHY_1M    0x01
+#define LINK_PHY_2M    0x02
+#define LINK_PHY_CODED 0x04
+
+/**
+ * @brief Receiver sensitivity of each PHY (nRF52840), in dBm.
+ *
+ */
+#define LINK_POLICY_SENSITIVITY_1M    -95
+#define LINK_POLICY_SENSITIVITY_2M    -92
+#define LINK_POLICY_SENSITIVITY_CODED -103
+
+/**
+ * @brief RSSI margin over the sensitivity above which the packet error rate stays at
+ * LINK_POLICY_PER_FLOOR, in dB. Below it the rate grows linearly up to 100%.
+ *
+ */
+#define LINK_POLICY_PER_MARGIN 10
+
+/**
+ * @brief Packet error rate of a link with enough margin, in percent.
+ *
+ */
+#define LINK_POLICY_PER_FLOOR 1U
+
+/**
+ * @brief GATT payload used to compare the goodput of the PHYs, in bytes.
+ *
+ */
+#define LINK_POLICY_PAYLOAD_LEN 20U
+
+/**
+ * @brief Expected goodput gain required to switch PHY, in percent.
+ *
+ */
+#define LINK_POLICY_GAIN 10U
+
+/**
+ * @brief Consecutive periods voting for the same change before the PHY is switched.
+ *
+ */
+#define LINK_POLICY_STABLE_PERIODS 2U
+
+/** @brief Advertiser offering the UART service, ranked by smoothed RSSI. */
+struct link_candidate {
+    uint8_t addr[LINK_POLICY_ADDR_LEN];
+    int16_t rssi_x16;
+    uint16_t samples;
+};
+
+/** @brief Candidates collected during one scan window. */
+struct link_candidates {
+    struct link_candidate items[LINK_POLICY_MAX_CANDIDATES];
+    size_t count;
+};
+
+/** @brief Link quality state of one connection. */
+struct link_policy {
+    uint8_t phy;
+    uint32_t interval_us;
+    uint16_t latency;
+    uint32_t rtt_base_us;
+    int16_t rssi_x16;
+    bool has_rssi;
+    uint8_t target;
+    uint8_t votes;
+};
+
+/** @brief Link quality measured over one period. */
+struct link_period {
+    int8_t rssi;
+    bool has_rssi;
+    uint32_t echoes;
+    uint32_t rtt_sum_us;
+};
+
+/**
+ * @brief Removes every candidate.
+ * @param list The candidate list.
+ */
+void link_candidates_reset(struct link_candidates *list);
+
+/**
+ * @brief Adds an advertising report, smoothing the RSSI of an already known candidate.
+ * @param list The candidate list.
+ * @param addr The advertiser address (LINK_POLICY_ADDR_LEN bytes).
+ * @param rssi The RSSI of the advertising report, in dBm.
+ * @return 0 on success, -1 if the list is full.
+ */
+int link_candidates_add(struct link_candidates *list, const uint8_t *addr, int8_t rssi);
+
+/**
+ * @brief Removes a candidate, e.g. after a failed connection attempt.
+ * @param list The candidate list.
+ * @param addr The advertiser address (LINK_POLICY_ADDR_LEN bytes).
+ */
+void link_candidates_remove(struct link_candidates *list, const uint8_t *addr);
+
+/**
+ * @brief Returns the candidate with the strongest smoothed RSSI.
+ * @param list The candidate list.
+ * @return The best candidate, or NULL if the list is empty.
+ */
+const struct link_candidate *link_candidates_best(const struct link_candidates *list);
+
+/**
+ * @brief Returns the smoothed RSSI of a candidate.
+ * @param candidate The candidate.
+ * @return The smoothed RSSI, in dBm.
+ */
+int8_t link_candidate_rssi(const struct link_candidate *candidate);
+
+/**
+ * @brief Starts tracking a new connection.
+ * @param policy The link policy state.
+ * @param phy The current PHY of the connection.
+ * @param interval_us The connection interval, in us.
+ * @param latency The peripheral latency, in connection events.
+ */
+void link_policy_reset(struct link_policy *policy, uint8_t phy, uint32_t interval_us,
+                       uint16_t latency);
+
+/**
+ * @brief Records new connection parameters.
+ * @param policy The link policy state.
+ * @param interval_us The connection interval, in us.
+ * @param latency The peripheral latency, in connection events.
+ */
+void link_policy_set_conn_params(struct link_policy *policy, uint32_t interval_us,
+                                 uint16_t latency);
+
+/**
+ * @brief Records the PHY actually in use after a PHY update.
+ * @param policy The link policy state.
+ * @param phy The new PHY of the connection.
+ */
+void link_policy_set_phy(struct link_policy *policy, uint8_t phy);
+
+/**
+ * @brief Feeds one measurement period and returns the PHY the connection should use.
+ *
+ * The expected goodput of the current PHY and of its neighbours (Coded, 1M, 2M) is
+ * estimated from the smoothed RSSI. For the current PHY the packet error rate implied
+ * by the echo round-trip time is used when it is worse than the estimate: every
+ * retransmission delays an echo by one connection interval. Delays up to the
+ * peripheral latency plus one interval of phase jitter over the fastest period on the
+ * current PHY are not counted, as a write may wait that long for the peripheral to
+ * listen. The PHY
+ * moves to a neighbour only when it is expected to give LINK_POLICY_GAIN percent more
+ * goodput for LINK_POLICY_STABLE_PERIODS periods in a row.
+ *
+ * @param policy The link policy state.
+ * @param period RSSI and echo round-trip times of the period.
+ * @return The PHY to use, equal to policy->phy when no change is needed.
+ */
+uint8_t link_policy_evaluate(struct link_policy *policy, const struct link_period *period);
+
+/**
+ * @brief Returns the smoothed connection RSSI.
+ * @param policy The link policy state.
+ * @return The smoothed RSSI, in dBm.
+ */
+int8_t link_policy_rssi(const struct link_policy *policy);
+
+/**
+ * @brief Estimates the packet error rate of a PHY from the RSSI.
+ * @param phy The PHY.
+ * @param rssi The RSSI, in dBm.
+ * @return The packet error rate, in percent.
+ */
+uint32_t link_policy_per(uint8_t phy, int8_t rssi);
+
+/**
+ * @brief Estimates the goodput of a connection that sends one payload per exchange.
+ * @param phy The PHY of the connection.
+ * @param payload_len The GATT payload of each packet, in bytes.
+ * @param interval_us The connection interval, in us.
+ * @param per_pct The packet error rate, in percent.
+ * @return The goodput, in bytes per second.
+ */
+uint32_t link_policy_goodput(uint8_t phy, size_t payload_len, uint32_t interval_us,
+                             uint32_t per_pct);
+
+/**
+ * @brief Returns a printable name for a PHY.
+ * @param phy The PHY.
+ * @return "1M", "2M" or "Coded".
+ */
+const char *link_phy_str(uint8_t phy);
+
+#endif /* LINK_POLICY_H_ */
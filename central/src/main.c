@@ -5,6 +5,7 @@
 #include <bluetooth/hci.h>
 #include <bluetooth/uuid.h>
 #include <console/console.h>
+#include <debug/thread_analyzer.h>
 #include <errno.h>
 #include <kernel.h>
 #include <stddef.h>
@@ -17,6 +18,10 @@
 
 #include "central.h"
 
+BUILD_ASSERT(sizeof(bt_addr_le_t) == LINK_POLICY_ADDR_LEN);
+BUILD_ASSERT(LINK_PHY_1M == BT_GAP_LE_PHY_1M && LINK_PHY_2M == BT_GAP_LE_PHY_2M
+             && LINK_PHY_CODED == BT_GAP_LE_PHY_CODED);
+
 void mtu_updated(struct bt_conn *conn, uint16_t tx, uint16_t rx)
 {
     printk("MTU was updated. Max Transmit Bytes (TX): %d\nMax Receive Bytes (RX):%d.\n", tx, rx);
@@ -24,7 +29,7 @@ void mtu_updated(struct bt_conn *conn, uint16_t tx, uint16_t rx)
 
 static bool found_service_handler(struct bt_data *data, void *user_data)
 {
-    bt_addr_le_t *addr = user_data;
+    struct scan_report *report = user_data;
     int i;
     printk("Data type: %u\nData length: %u.\n", data->type, data->data_len);
 
@@ -35,10 +40,8 @@ static bool found_service_handler(struct bt_data *data, void *user_data)
         int num_elems = data->data_len / sizeof(uint16_t);
 
         for (i = 0; i < num_elems; i++) {
-            struct bt_le_conn_param *bt_param;
             struct bt_uuid *uuid;
             uint16_t u16;
-            int err;
 
             u16 = sys_le16_to_cpu(*data_ptr);
             uuid = BT_UUID_DECLARE_16(u16);
@@ -47,19 +50,7 @@ static bool found_service_handler(struct bt_data *data, void *user_data)
                 continue;
             }
 
-            err = bt_le_scan_stop();
-            if (err) {
-                printk("Fail: Scan couldn't stop. Error: %d.\n", err);
-                data_ptr++;
-                continue;
-            }
-
-            bt_param = BT_LE_CONN_PARAM_DEFAULT;
-            err = bt_conn_le_create(addr, BT_CONN_LE_CREATE_CONN, bt_param, &default_conn);
-            if (err) {
-                printk("Fail: Couldn't create conn. Error: %d.\n", err);
-                scanBluetoothDevices(0);
-            }
+            candidate_found(report->addr, report->rssi);
 
             return false;
         }
@@ -81,11 +72,85 @@ static void found_device_handler(const bt_addr_le_t *device_address, int8_t rssi
 
     printk("New device found with address: %s and RSSI: %d.\n", device_address_str, rssi);
 
-    if (rssi < -70) {
+    if (rssi < CONFIG_APP_SCAN_RSSI_FLOOR) {
         return;
     }
-   
-    bt_data_parse(advertising_data, found_service_handler, (void *) device_address);
+
+    struct scan_report report = {
+        .addr = device_address,
+        .rssi = rssi,
+    };
+
+    bt_data_parse(advertising_data, found_service_handler, &report);
+}
+
+static void candidate_found(const bt_addr_le_t *addr, int8_t rssi)
+{
+    k_mutex_lock(&candidates_lock, K_FOREVER);
+
+    /* Advertisers beyond LINK_POLICY_MAX_CANDIDATES are ignored for this window. */
+    (void) link_candidates_add(&candidates, (const uint8_t *) addr, rssi);
+
+    if (!selecting) {
+        selecting = true;
+        k_timer_start(&candidate_timer, K_MSEC(CANDIDATE_WINDOW_MS), K_NO_WAIT);
+    }
+
+    k_mutex_unlock(&candidates_lock);
+}
+
+static void candidate_window_expired(struct k_timer *timer)
+{
+    k_work_submit(&connect_work);
+}
+
+static void connect_best_candidate(struct k_work *work)
+{
+    const struct link_candidate *best;
+    char address[BT_ADDR_LE_STR_LEN];
+    bt_addr_le_t addr;
+    uint32_t count;
+    int8_t rssi;
+    int err;
+
+    /* Scanning is already stopped when falling back after a failed connection. */
+    err = bt_le_scan_stop();
+    if (err && err != -EALREADY) {
+        printk("Fail: Scan couldn't stop. Error: %d.\n", err);
+    }
+
+    energy_scan_stopped();
+
+    while (true) {
+        k_mutex_lock(&candidates_lock, K_FOREVER);
+        best = link_candidates_best(&candidates);
+        if (best) {
+            memcpy(&addr, best->addr, sizeof(addr));
+            rssi  = link_candidate_rssi(best);
+            count = candidates.count;
+        }
+        k_mutex_unlock(&candidates_lock);
+
+        if (best == NULL) {
+            break;
+        }
+
+        bt_addr_le_to_str(&addr, address, sizeof(address));
+        printk("Best of %u candidates: %s. Smoothed RSSI: %d.\n", count, address, rssi);
+
+        err = bt_conn_le_create(&addr, BT_CONN_LE_CREATE_CONN, CONN_PARAM, &default_conn);
+        if (!err) {
+            return;
+        }
+
+        printk("Fail: Couldn't create conn. Error: %d.\n", err);
+
+        k_mutex_lock(&candidates_lock, K_FOREVER);
+        link_candidates_remove(&candidates, (const uint8_t *) &addr);
+        k_mutex_unlock(&candidates_lock);
+    }
+
+    scanBluetoothDevices(0);
 }
 
 
@@ -93,16 +158,23 @@ void scanBluetoothDevices(int error) {
     struct bt_le_scan_param scanParameters = {
         .type = BT_LE_SCAN_TYPE_ACTIVE,
         .options = BT_LE_SCAN_OPT_NONE,
-        .interval = BT_GAP_SCAN_FAST_INTERVAL,
-        .window = BT_GAP_SCAN_FAST_WINDOW,
+        .interval = SCAN_INTERVAL,
+        .window = SCAN_WINDOW,
     };
 
+    k_mutex_lock(&candidates_lock, K_FOREVER);
+    k_timer_stop(&candidate_timer);
+    link_candidates_reset(&candidates);
+    selecting = false;
+    k_mutex_unlock(&candidates_lock);
+
     error = bt_le_scan_start(&scanParameters, found_device_handler);
     if (error) {
         printk("Error: Unable to start scanning. Error code: %d\n", error);
         return;
     }
 
+    energy_scan_started(&scanParameters);
     printk("Success: Scanning started\n");
 }
 
@@ -116,11 +188,27 @@ static uint8_t central_notification_handler(struct bt_conn *connection,
         return BT_GATT_ITER_CONTINUE;
     }
 
-    char notification_data[buffer_length + 1];
-    memcpy(notification_data, notification_buffer, buffer_length);
-    notification_data[buffer_length] = '\0';
+    energy_rx(buffer_length);
+    echo_received();
+    atomic_add(&echo_bytes, buffer_length);
+
+    char *notification_data;
+    uint16_t data_length = MIN(buffer_length, CONFIG_APP_PAYLOAD_BUF_SIZE);
+
+    if (k_mem_slab_alloc(&payload_slab, (void **) &notification_data, K_NO_WAIT)) {
+        printk("No payload buffer available. Length: %u.\n", buffer_length);
+        return BT_GATT_ITER_CONTINUE;
+    }
+
+    memcpy(notification_data, notification_buffer, data_length);
+    notification_data[data_length] = '\0';
 
     printk("Notification Received. Data: %s. Length: %u.\n", notification_data, buffer_length);
+    if (data_length < buffer_length) {
+        printk("Notification truncated to %u bytes.\n", data_length);
+    }
+
+    k_mem_slab_free(&payload_slab, (void **) &notification_data);
 
     return BT_GATT_ITER_CONTINUE;
 }
@@ -203,10 +291,16 @@ static void connected(struct bt_conn *connection, uint8_t error)
     if (error) {
         printk("Failed to connect. Address: %s. Error code: %u\n", address, error);
 
+        /* Fall back to the next best candidate of the same window. */
+        k_mutex_lock(&candidates_lock, K_FOREVER);
+        link_candidates_remove(&candidates,
+                               (const uint8_t *) bt_conn_get_dst(connection));
+        k_mutex_unlock(&candidates_lock);
+
         bt_conn_unref(default_conn);
         default_conn = NULL;
 
-        scanBluetoothDevices(0);
+        k_work_submit(&connect_work);
         return;
     }
 
@@ -214,6 +308,25 @@ static void connected(struct bt_conn *connection, uint8_t error)
 
     if (connection == default_conn) {
         printk("Connected successfully. Address: %s\n", address);
+        energy_conn_started(connection);
+
+        struct bt_conn_info info;
+        k_spinlock_key_t key;
+
+        atomic_set(&conn_params, 0);
+        if (!bt_conn_get_info(connection, &info)) {
+            atomic_set(&conn_params, info.le.interval | (info.le.latency << 16));
+        }
+
+        /* phy_policy belongs to the link quality work, which restarts it. */
+        atomic_clear(&phy_updated);
+        atomic_set(&link_restart, 1);
+        key = k_spin_lock(&pending_echoes_lock);
+        memset(&pending_echoes, 0, sizeof(pending_echoes));
+        k_spin_unlock(&pending_echoes_lock, key);
+        atomic_set(&echo_bytes, 0);
+        k_timer_start(&link_quality_timer, K_MSEC(CONFIG_APP_LINK_QUALITY_PERIOD_MS),
+                      K_MSEC(CONFIG_APP_LINK_QUALITY_PERIOD_MS));
 
         memcpy(&uuid_t, BT_UART_SVC_UUID, sizeof(uuid_t));
         discover_params.uuid         = &uuid_t.uuid;
@@ -241,6 +354,8 @@ static void disconnected(struct bt_conn *connection, uint8_t reason)
     bt_addr_le_to_str(bt_conn_get_dst(connection), address, sizeof(address));
 
     printk("Device with address %s disconnected. Reason: 0x%02x\n", address, reason);
+    energy_conn_ended();
+    k_timer_stop(&link_quality_timer);
 
     bt_conn_unref(default_conn);
     default_conn = NULL;
@@ -248,6 +363,192 @@ static void disconnected(struct bt_conn *connection, uint8_t reason)
     scanBluetoothDevices(0);
 }
 
+static void le_param_updated(struct bt_conn *connection, uint16_t interval,
+                             uint16_t latency, uint16_t timeout)
+{
+    printk("Connection parameters updated. Interval: %u. Latency: %u. Timeout: %u.\n",
+           interval, latency, timeout);
+
+    if (connection == default_conn) {
+        energy_conn_param_updated(interval, latency);
+        atomic_set(&conn_params, interval | (latency << 16));
+    }
+}
+
+static void le_phy_updated(struct bt_conn *connection, struct bt_conn_le_phy_info *param)
+{
+    printk("PHY updated. TX: %s. RX: %s.\n", link_phy_str(param->tx_phy),
+           link_phy_str(param->rx_phy));
+
+    if (connection == default_conn) {
+        energy_set_phy(param->tx_phy, param->rx_phy);
+        atomic_set(&phy_updated, param->tx_phy);
+    }
+}
+
+static int read_conn_rssi(struct bt_conn *connection, int8_t *rssi)
+{
+    struct bt_hci_cp_read_rssi *cp;
+    struct bt_hci_rp_read_rssi *rp;
+    struct net_buf *buf;
+    struct net_buf *rsp = NULL;
+    uint16_t handle;
+    int err;
+
+    err = bt_hci_get_conn_handle(connection, &handle);
+    if (err) {
+        return err;
+    }
+
+    buf = bt_hci_cmd_create(BT_HCI_OP_READ_RSSI, sizeof(*cp));
+    if (!buf) {
+        return -ENOBUFS;
+    }
+
+    cp         = net_buf_add(buf, sizeof(*cp));
+    cp->handle = sys_cpu_to_le16(handle);
+
+    err = bt_hci_cmd_send_sync(BT_HCI_OP_READ_RSSI, buf, &rsp);
+    if (err) {
+        return err;
+    }
+
+    rp    = (void *) rsp->data;
+    *rssi = rp->rssi;
+    net_buf_unref(rsp);
+
+    return 0;
+}
+
+static void request_phy(struct bt_conn *connection, uint8_t phy)
+{
+    const struct bt_conn_le_phy_param *param;
+    int err;
+
+    switch (phy) {
+    case LINK_PHY_2M:
+        param = BT_CONN_LE_PHY_PARAM_2M;
+        break;
+    case LINK_PHY_CODED:
+        param = BT_CONN_LE_PHY_PARAM_CODED;
+        break;
+    default:
+        param = BT_CONN_LE_PHY_PARAM_1M;
+        break;
+    }
+
+    err = bt_conn_le_phy_update(connection, param);
+    if (err) {
+        printk("Failed to update PHY to %s. Error: %d.\n", link_phy_str(phy), err);
+    }
+}
+
+static void echo_write_sent(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&pending_echoes_lock);
+    size_t tail;
+
+    if (pending_echoes.count == ECHO_PENDING_MAX) {
+        /* The oldest write is still unanswered: drop it as lost. */
+        pending_echoes.head = (pending_echoes.head + 1) % ECHO_PENDING_MAX;
+        pending_echoes.count--;
+    }
+
+    tail = (pending_echoes.head + pending_echoes.count) % ECHO_PENDING_MAX;
+
+    pending_echoes.sent_ms[tail] = k_uptime_get_32();
+    pending_echoes.count++;
+
+    k_spin_unlock(&pending_echoes_lock, key);
+}
+
+static void echo_received(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&pending_echoes_lock);
+    uint32_t now         = k_uptime_get_32();
+
+    while (pending_echoes.count) {
+        uint32_t rtt = now - pending_echoes.sent_ms[pending_echoes.head];
+
+        pending_echoes.head = (pending_echoes.head + 1) % ECHO_PENDING_MAX;
+        pending_echoes.count--;
+
+        if (rtt <= CONFIG_APP_LINK_QUALITY_PERIOD_MS) {
+            pending_echoes.rtt_sum_ms += rtt;
+            pending_echoes.echoes++;
+            break;
+        }
+    }
+
+    k_spin_unlock(&pending_echoes_lock, key);
+}
+
+static void link_quality_timer_expired(struct k_timer *timer)
+{
+    k_work_submit(&link_quality_work);
+}
+
+static void link_quality_handler(struct k_work *work)
+{
+    struct link_period period = {0};
+    struct bt_conn *connection;
+    k_spinlock_key_t key;
+    atomic_val_t params;
+    uint32_t interval_us;
+    uint32_t goodput;
+    uint16_t latency;
+    uint8_t phy;
+
+    if (default_conn == NULL) {
+        return;
+    }
+
+    /* disconnected() may drop default_conn while the RSSI read blocks. */
+    connection = bt_conn_ref(default_conn);
+
+    params      = atomic_get(&conn_params);
+    interval_us = (params & 0xffff) * 1250U;
+    latency     = (uint16_t) (params >> 16);
+
+    if (atomic_clear(&link_restart)) {
+        link_policy_reset(&phy_policy, LINK_PHY_1M, interval_us, latency);
+    }
+
+    phy = (uint8_t) atomic_clear(&phy_updated);
+    if (phy) {
+        link_policy_set_phy(&phy_policy, phy);
+    }
+
+    period.has_rssi = !read_conn_rssi(connection, &period.rssi);
+
+    key                       = k_spin_lock(&pending_echoes_lock);
+    period.echoes             = pending_echoes.echoes;
+    period.rtt_sum_us         = pending_echoes.rtt_sum_ms * 1000U;
+    pending_echoes.echoes     = 0;
+    pending_echoes.rtt_sum_ms = 0;
+    k_spin_unlock(&pending_echoes_lock, key);
+
+    goodput = (uint32_t) atomic_set(&echo_bytes, 0) * 1000U
+              / CONFIG_APP_LINK_QUALITY_PERIOD_MS;
+
+    link_policy_set_conn_params(&phy_policy, interval_us, latency);
+    phy = link_policy_evaluate(&phy_policy, &period);
+
+    if (period.echoes || phy != phy_policy.phy) {
+        printk("Link quality. RSSI: %d dBm. Echoes: %u. RTT: %u ms. Goodput: %u B/s. "
+               "PHY: %s -> %s.\n",
+               link_policy_rssi(&phy_policy), period.echoes,
+               period.echoes ? period.rtt_sum_us / 1000U / period.echoes : 0U, goodput,
+               link_phy_str(phy_policy.phy), link_phy_str(phy));
+    }
+
+    if (phy != phy_policy.phy) {
+        request_phy(connection, phy);
+    }
+
+    bt_conn_unref(connection);
+}
+
 
 static void input_task(void)
 {
@@ -267,6 +568,16 @@ static void input_task(void)
             continue;
         }
 
+        if (!strcmp(input, ENERGY_REPORT_CMD)) {
+            energy_report();
+            continue;
+        }
+
+        if (!strcmp(input, STACK_REPORT_CMD)) {
+            thread_analyzer_print();
+            continue;
+        }
+
         printk("Sending input: %s\n", input);
 
         if (default_conn == NULL) {
@@ -278,6 +589,9 @@ static void input_task(void)
                                             strlen(input), false);
         if (err) {
             printk("Failed to write. Error: %d\n", err);
+        } else {
+            energy_tx(strlen(input));
+            echo_write_sent();
         }
     }
 }
@@ -288,6 +602,7 @@ int main(void)
     printk("Hello! I'm using Zephyr %s on %s, a %s board. \n\n", KERNEL_VERSION_STRING,
            CONFIG_BOARD, CONFIG_ARCH);
 
+    energy_init(ENERGY_ROLE_CENTRAL);
     bt_conn_cb_register(&conn_cb);
     bt_gatt_cb_register(&gatt_cb);
     err = bt_enable(scanBluetoothDevices);
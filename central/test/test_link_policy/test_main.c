@@ -0,0 +1,362 @@
+/*
+ * Simulated multi-peripheral scenario for the candidate ranking and PHY policy. The
+ * PHY decisions are checked against an independent model of the simulated channel.
+ *
+ *     pio test -e native
+ */
+
+#include <link_policy.h>
+#include <stdio.h>
+#include <unity.h>
+
+/** @brief Connection interval of the simulated link, in us (BT_LE_CONN_PARAM_DEFAULT). */
+#define SIM_INTERVAL_US 30000U
+
+/** @brief GATT payload of each simulated echo. */
+#define SIM_PAYLOAD_LEN 20U
+
+/** @brief Echo writes sent per simulated period on a busy link. */
+#define SIM_WRITES 50U
+
+static const uint8_t peer_a[LINK_POLICY_ADDR_LEN] = {0, 0xa1, 0, 0, 0, 0, 0xc0};
+static const uint8_t peer_b[LINK_POLICY_ADDR_LEN] = {0, 0xb2, 0, 0, 0, 0, 0xc0};
+static const uint8_t peer_c[LINK_POLICY_ADDR_LEN] = {0, 0xc3, 0, 0, 0, 0, 0xc0};
+static const uint8_t peer_d[LINK_POLICY_ADDR_LEN] = {0, 0xd4, 0, 0, 0, 0, 0xc0};
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+/*
+ * Ground truth of the simulated channel, independent of the link policy model:
+ * - PER of each PHY follows a steep curve around its 50% point,
+ * - a connection event carries packets until the first CRC error,
+ * - RSSI reports carry +-3 dB of noise,
+ * - an echo waits up to latency + 1 intervals for the peripheral to listen, and each of
+ *   its two packets is retried once per interval until received.
+ */
+
+/** @brief A simulated peripheral link. */
+struct sim_channel {
+    int8_t rssi;
+    uint32_t interval_us;
+    uint16_t latency;
+    uint32_t writes;
+};
+
+/** @brief Measurement period of the simulated link, in us. */
+#define SIM_PERIOD_US 2000000U
+
+/** @brief PER, in percent, from 4 dB below to 5 dB above the 50% point of a PHY. */
+static const uint8_t sim_per_curve[] = {100, 95, 85, 70, 50, 30, 15, 7, 3, 1};
+
+static uint32_t sim_seed;
+
+static uint32_t sim_rand(uint32_t range)
+{
+    sim_seed = sim_seed * 1103515245U + 12345U;
+    return (sim_seed >> 8) % range;
+}
+
+static uint32_t sim_per(uint8_t phy, int rssi)
+{
+    int half  = phy == LINK_PHY_2M ? -90 : (phy == LINK_PHY_CODED ? -101 : -93);
+    int index = rssi - half + 4;
+
+    if (index < 0) {
+        return 100U;
+    }
+    if (index >= (int) sizeof(sim_per_curve)) {
+        return sim_per_curve[sizeof(sim_per_curve) - 1];
+    }
+    return sim_per_curve[index];
+}
+
+/* Airtime of a PDU from the framing and symbol rate of each PHY. */
+static uint32_t sim_airtime_us(uint8_t phy, uint32_t pdu_len)
+{
+    switch (phy) {
+    case LINK_PHY_2M:
+        /* 2 byte preamble, access address, header, PDU and CRC at 2 Mbit/s. */
+        return (2U + 4U + 2U + pdu_len + 3U) * 8U / 2U;
+    case LINK_PHY_CODED:
+        /* Preamble, S8 access address, CI and TERM1, then S8 header, PDU, CRC, TERM2. */
+        return 80U + 256U + 16U + 24U + (2U + pdu_len + 3U) * 64U + 24U;
+    default:
+        return (1U + 4U + 2U + pdu_len + 3U) * 8U;
+    }
+}
+
+/* Expected goodput of the channel on a PHY, in bytes per second. */
+static uint32_t sim_goodput(const struct sim_channel *channel, uint8_t phy)
+{
+    uint32_t exchange_us = sim_airtime_us(phy, SIM_PAYLOAD_LEN + 7U)
+                           + sim_airtime_us(phy, 0) + 2U * 150U;
+    uint32_t slots       = channel->interval_us / exchange_us;
+    double success       = 1.0 - sim_per(phy, channel->rssi) / 100.0;
+    double delivered     = 0.0;
+    double reached       = 1.0;
+
+    for (uint32_t i = 0; i < slots; i++) {
+        reached *= success;
+        delivered += reached;
+    }
+
+    return (uint32_t) (delivered * SIM_PAYLOAD_LEN * 1000000.0 / channel->interval_us);
+}
+
+static uint8_t sim_best_phy(const struct sim_channel *channel)
+{
+    static const uint8_t phys[] = {LINK_PHY_2M, LINK_PHY_1M, LINK_PHY_CODED};
+    uint8_t best                = phys[0];
+
+    for (size_t i = 1; i < sizeof(phys); i++) {
+        if (sim_goodput(channel, phys[i]) > sim_goodput(channel, best)) {
+            best = phys[i];
+        }
+    }
+
+    return best;
+}
+
+static uint32_t sim_echo_rtt_us(const struct sim_channel *channel, uint32_t per)
+{
+    uint32_t rtt_us = sim_rand((channel->latency + 1U) * channel->interval_us);
+
+    for (int packet = 0; packet < 2; packet++) {
+        rtt_us += channel->interval_us;
+        while (sim_rand(100) < per) {
+            rtt_us += channel->interval_us;
+        }
+    }
+
+    return rtt_us;
+}
+
+/* Runs `periods` measurement periods and returns the PHY in use afterwards. Fails if any
+ * decision lowers the goodput of the channel. */
+static uint8_t sim_link(struct link_policy *policy, const struct sim_channel *channel,
+                        int periods)
+{
+    link_policy_set_conn_params(policy, channel->interval_us, channel->latency);
+
+    for (int i = 0; i < periods; i++) {
+        uint8_t phy             = policy->phy;
+        uint32_t per            = sim_per(phy, channel->rssi);
+        struct link_period data = {
+            .rssi     = (int8_t) (channel->rssi + (int) sim_rand(7) - 3),
+            .has_rssi = true,
+        };
+        uint8_t next;
+
+        for (uint32_t echo = 0; per < 100U && echo < channel->writes; echo++) {
+            uint32_t rtt_us = sim_echo_rtt_us(channel, per);
+
+            if (rtt_us <= SIM_PERIOD_US) {
+                data.rtt_sum_us += rtt_us;
+                data.echoes++;
+            }
+        }
+
+        next = link_policy_evaluate(policy, &data);
+
+        printf("RSSI %4d dBm (%4d), PHY %-5s, PER %3u%%, goodput %6u B/s -> %s "
+               "(%u B/s)\n",
+               channel->rssi, data.rssi, link_phy_str(phy), per,
+               sim_goodput(channel, phy), link_phy_str(next), sim_goodput(channel, next));
+
+        TEST_ASSERT_GREATER_OR_EQUAL_UINT32(sim_goodput(channel, phy),
+                                            sim_goodput(channel, next));
+
+        if (next != phy) {
+            link_policy_set_phy(policy, next);
+        }
+    }
+
+    return policy->phy;
+}
+
+static void test_strongest_candidate_is_chosen(void)
+{
+    struct link_candidates list;
+    const struct link_candidate *best;
+
+    link_candidates_reset(&list);
+
+    /* B is the first matching advertiser, as the old code would have connected to. */
+    link_candidates_add(&list, peer_b, -75);
+    link_candidates_add(&list, peer_a, -80);
+    /* D has a single strong spike among weak reports. */
+    link_candidates_add(&list, peer_d, -88);
+    link_candidates_add(&list, peer_d, -40);
+    link_candidates_add(&list, peer_d, -88);
+    link_candidates_add(&list, peer_d, -88);
+    /* C shows up last but is consistently the strongest. */
+    link_candidates_add(&list, peer_c, -62);
+    link_candidates_add(&list, peer_b, -74);
+    link_candidates_add(&list, peer_c, -61);
+    link_candidates_add(&list, peer_a, -81);
+
+    best = link_candidates_best(&list);
+    TEST_ASSERT_NOT_NULL(best);
+    TEST_ASSERT_EQUAL_MEMORY(peer_c, best->addr, LINK_POLICY_ADDR_LEN);
+    TEST_ASSERT_EQUAL_INT(2, best->samples);
+
+    /* A failed connection to C falls back to the next best, B. */
+    link_candidates_remove(&list, peer_c);
+    best = link_candidates_best(&list);
+    TEST_ASSERT_EQUAL_MEMORY(peer_b, best->addr, LINK_POLICY_ADDR_LEN);
+}
+
+static void test_candidate_list_is_bounded(void)
+{
+    struct link_candidates list;
+    uint8_t addr[LINK_POLICY_ADDR_LEN] = {0};
+
+    link_candidates_reset(&list);
+
+    for (int i = 0; i < LINK_POLICY_MAX_CANDIDATES; i++) {
+        addr[1] = (uint8_t) i;
+        TEST_ASSERT_EQUAL_INT(0, link_candidates_add(&list, addr, -70));
+    }
+
+    addr[1] = LINK_POLICY_MAX_CANDIDATES;
+    TEST_ASSERT_EQUAL_INT(-1, link_candidates_add(&list, addr, -30));
+    TEST_ASSERT_NULL(link_candidates_best(&(struct link_candidates){0}));
+}
+
+static void test_phy_maximizes_goodput(void)
+{
+    static const struct {
+        const char *name;
+        struct sim_channel channel;
+    } steps[] = {
+        {"Strong link", {-55, SIM_INTERVAL_US, 0, SIM_WRITES}},
+        {"Fading link", {-88, SIM_INTERVAL_US, 0, SIM_WRITES}},
+        {"Edge of the 1M range", {-97, SIM_INTERVAL_US, 0, SIM_WRITES}},
+        {"Recovered link", {-72, SIM_INTERVAL_US, 0, SIM_WRITES}},
+    };
+    /* Tuned profile with one echo per second: the peripheral latency inflates every
+     * echo round trip and two echoes do not average it out. */
+    static const struct sim_channel tuned = {-60, 150000U, 4, 2};
+    struct link_policy policy;
+
+    sim_seed = 1;
+    link_policy_reset(&policy, LINK_PHY_1M, SIM_INTERVAL_US, 0);
+
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        printf("%s:\n", steps[i].name);
+        TEST_ASSERT_EQUAL_UINT8(sim_best_phy(&steps[i].channel),
+                                sim_link(&policy, &steps[i].channel, 12));
+    }
+
+    printf("New connection with tuned parameters:\n");
+    link_policy_reset(&policy, LINK_PHY_1M, tuned.interval_us, tuned.latency);
+    TEST_ASSERT_EQUAL_UINT8(sim_best_phy(&tuned), sim_link(&policy, &tuned, 12));
+}
+
+static void test_slow_echoes_leave_2m(void)
+{
+    struct link_policy policy;
+    struct link_period fast = {
+        .rssi       = -70,
+        .has_rssi   = true,
+        .echoes     = 10,
+        .rtt_sum_us = 10 * 2 * SIM_INTERVAL_US,
+    };
+    /* Strong RSSI but every echo needs three extra intervals: 60% PER on 2M. */
+    struct link_period slow = {
+        .rssi       = -70,
+        .has_rssi   = true,
+        .echoes     = 10,
+        .rtt_sum_us = 10 * 6 * SIM_INTERVAL_US,
+    };
+
+    link_policy_reset(&policy, LINK_PHY_2M, SIM_INTERVAL_US, 0);
+
+    TEST_ASSERT_EQUAL_UINT8(LINK_PHY_2M, link_policy_evaluate(&policy, &fast));
+    TEST_ASSERT_EQUAL_UINT8(LINK_PHY_2M, link_policy_evaluate(&policy, &slow));
+    TEST_ASSERT_EQUAL_UINT8(LINK_PHY_1M, link_policy_evaluate(&policy, &slow));
+}
+
+static void test_latency_keeps_phy(void)
+{
+    struct link_policy policy;
+    uint8_t switches = 0;
+
+    /* Tuned profile: 150 ms interval and peripheral latency 4. A write waits up to five
+     * intervals for the peripheral to listen, without any packet error. */
+    link_policy_reset(&policy, LINK_PHY_1M, 150000U, 4);
+
+    for (int i = 0; i < 12; i++) {
+        struct link_period period = {
+            .rssi       = -60,
+            .has_rssi   = true,
+            .echoes     = 1,
+            .rtt_sum_us = (i % 4 ? 3U : 1U) * 150000U,
+        };
+        uint8_t phy = link_policy_evaluate(&policy, &period);
+
+        if (phy != policy.phy) {
+            link_policy_set_phy(&policy, phy);
+            switches++;
+        }
+    }
+
+    TEST_ASSERT_EQUAL_UINT8(LINK_PHY_2M, policy.phy);
+    TEST_ASSERT_EQUAL_UINT8(1, switches);
+}
+
+static void test_single_bad_period_keeps_phy(void)
+{
+    struct link_policy policy;
+    struct link_period good = {
+        .rssi       = -60,
+        .has_rssi   = true,
+        .echoes     = 10,
+        .rtt_sum_us = 10 * 2 * SIM_INTERVAL_US,
+    };
+    struct link_period bad = {
+        .rssi       = -60,
+        .has_rssi   = true,
+        .echoes     = 10,
+        .rtt_sum_us = 10 * 4 * SIM_INTERVAL_US,
+    };
+
+    link_policy_reset(&policy, LINK_PHY_2M, SIM_INTERVAL_US, 0);
+
+    TEST_ASSERT_EQUAL_UINT8(LINK_PHY_2M, link_policy_evaluate(&policy, &good));
+    TEST_ASSERT_EQUAL_UINT8(LINK_PHY_2M, link_policy_evaluate(&policy, &bad));
+    TEST_ASSERT_EQUAL_UINT8(LINK_PHY_2M, link_policy_evaluate(&policy, &good));
+}
+
+static void test_goodput_per_phy(void)
+{
+    uint32_t goodput_2m    = link_policy_goodput(LINK_PHY_2M, 20, SIM_INTERVAL_US, 0);
+    uint32_t goodput_1m    = link_policy_goodput(LINK_PHY_1M, 20, SIM_INTERVAL_US, 0);
+    uint32_t goodput_coded = link_policy_goodput(LINK_PHY_CODED, 20, SIM_INTERVAL_US, 0);
+
+    printf("Goodput without errors: 2M %u B/s, 1M %u B/s, Coded %u B/s\n", goodput_2m,
+           goodput_1m, goodput_coded);
+
+    TEST_ASSERT_GREATER_THAN_UINT32(goodput_1m, goodput_2m);
+    TEST_ASSERT_GREATER_THAN_UINT32(goodput_coded, goodput_1m);
+    TEST_ASSERT_EQUAL_UINT32(0, link_policy_goodput(LINK_PHY_1M, 20, SIM_INTERVAL_US, 100));
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_strongest_candidate_is_chosen);
+    RUN_TEST(test_candidate_list_is_bounded);
+    RUN_TEST(test_phy_maximizes_goodput);
+    RUN_TEST(test_slow_echoes_leave_2m);
+    RUN_TEST(test_latency_keeps_phy);
+    RUN_TEST(test_single_bad_period_keeps_phy);
+    RUN_TEST(test_goodput_per_phy);
+    return UNITY_END();
+}
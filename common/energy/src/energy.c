@@ -0,0 +1,382 @@
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/conn.h>
+#include <bluetooth/gap.h>
+#include <kernel.h>
+#include <string.h>
+#include <sys/printk.h>
+#include <sys/util.h>
+#include <zephyr.h>
+
+#include "energy.h"
+
+/** @brief Fixed part of a Coded PHY (S=8) packet: preamble, AA, CI, TERM1 and TERM2. */
+#define CODED_S8_FIXED_US 400U
+
+/** @brief Payload of a SCAN_REQ/CONNECT_IND header listened for after each ADV_IND. */
+#define ADV_RX_PDU_LEN 12U
+
+/** @brief Advertising channels used on every advertising event. */
+#define ADV_CHANNELS 3U
+
+/** @brief Average of the random 0-10 ms advDelay added to every advertising event. */
+#define ADV_DELAY_US 5000U
+
+/** @brief Counters kept for the current connection and since boot. */
+struct energy_counters {
+    uint64_t scan_us;
+    uint64_t adv_events;
+    uint64_t conn_events;
+    uint32_t tx_packets;
+    uint32_t rx_packets;
+    uint64_t tx_bytes;
+    uint64_t rx_bytes;
+    uint64_t tx_on_us;
+    uint64_t rx_on_us;
+};
+
+static struct k_spinlock lock;
+static struct energy_counters total;
+static struct energy_counters current;
+static uint8_t local_role;
+static int64_t boot_ms;
+static int64_t checkpoint_ms;
+static int64_t link_start_ms;
+static int64_t link_end_ms;
+
+static bool scanning;
+static uint32_t scan_interval_us;
+static uint32_t scan_window_us;
+
+static bool advertising;
+static uint32_t adv_interval_us;
+static uint32_t adv_pdu_len;
+static uint64_t adv_remainder_us;
+
+static bool connected;
+static uint32_t conn_interval_us;
+static uint16_t conn_latency;
+static uint64_t conn_remainder_us;
+static uint8_t conn_tx_phy = BT_GAP_LE_PHY_1M;
+static uint8_t conn_rx_phy = BT_GAP_LE_PHY_1M;
+
+static uint32_t airtime_us(uint8_t phy, size_t pdu_len)
+{
+    switch (phy) {
+    case BT_GAP_LE_PHY_2M:
+        /* 2 byte preamble, 4 byte AA, 2 byte header, 3 byte CRC at 2 Mbit/s. */
+        return (11U + pdu_len) * 4U;
+    case BT_GAP_LE_PHY_CODED:
+        /* Header, payload and CRC at 125 kbit/s. */
+        return CODED_S8_FIXED_US + (5U + pdu_len) * 64U;
+    default:
+        /* 1 byte preamble, 4 byte AA, 2 byte header, 3 byte CRC at 1 Mbit/s. */
+        return (10U + pdu_len) * 8U;
+    }
+}
+
+static void add_tx_on(uint64_t us)
+{
+    total.tx_on_us += us;
+    if (connected) {
+        current.tx_on_us += us;
+    }
+}
+
+static void add_rx_on(uint64_t us)
+{
+    total.rx_on_us += us;
+    if (connected) {
+        current.rx_on_us += us;
+    }
+}
+
+/* Accrues scan, advertising and connection event airtime up to now. Call with lock held. */
+static void checkpoint(void)
+{
+    int64_t now        = k_uptime_get();
+    uint64_t elapsed_us = (uint64_t) (now - checkpoint_ms) * 1000U;
+
+    checkpoint_ms = now;
+
+    if (scanning && scan_interval_us) {
+        total.scan_us += elapsed_us;
+        add_rx_on(elapsed_us * scan_window_us / scan_interval_us);
+    }
+
+    if (advertising && adv_interval_us) {
+        uint64_t events;
+
+        adv_remainder_us += elapsed_us;
+        events = adv_remainder_us / adv_interval_us;
+        adv_remainder_us %= adv_interval_us;
+
+        total.adv_events += events;
+        add_tx_on(events * ADV_CHANNELS
+                  * (ENERGY_RAMP_UP_US + airtime_us(BT_GAP_LE_PHY_1M, adv_pdu_len)));
+        add_rx_on(events * ADV_CHANNELS
+                  * (ENERGY_T_IFS_US + airtime_us(BT_GAP_LE_PHY_1M, ADV_RX_PDU_LEN)));
+    }
+
+    if (connected && conn_interval_us) {
+        uint64_t events;
+
+        conn_remainder_us += elapsed_us;
+        events = conn_remainder_us / conn_interval_us;
+        conn_remainder_us %= conn_interval_us;
+
+        /* An idle peripheral may sleep through `latency` events in a row. */
+        if (local_role == ENERGY_ROLE_PERIPHERAL) {
+            events /= (uint64_t) conn_latency + 1U;
+        }
+
+        total.conn_events += events;
+        current.conn_events += events;
+
+        /* Every event is at least one empty PDU exchanged each way. */
+        add_tx_on(events * (ENERGY_RAMP_UP_US + airtime_us(conn_tx_phy, 0)));
+        add_rx_on(events
+                  * (ENERGY_RAMP_UP_US + ENERGY_T_IFS_US + airtime_us(conn_rx_phy, 0)));
+    }
+}
+
+static uint64_t energy_nj(const struct energy_counters *c)
+{
+    return (c->tx_on_us * ENERGY_TX_CURRENT_UA + c->rx_on_us * ENERGY_RX_CURRENT_UA)
+           * ENERGY_SUPPLY_MV / 1000000U;
+}
+
+static void print_counters(const char *name, const struct energy_counters *c,
+                           uint64_t elapsed_ms)
+{
+    uint64_t on_us    = c->tx_on_us + c->rx_on_us;
+    uint64_t nj       = energy_nj(c);
+    uint64_t bytes    = c->tx_bytes + c->rx_bytes;
+    uint32_t duty_mpc = elapsed_ms ? (uint32_t) (on_us * 100U / elapsed_ms) : 0U;
+    uint32_t nj_byte  = bytes ? (uint32_t) (nj / bytes) : 0U;
+    char per_byte[16] = "-";
+
+    printk("[%s] Time: %u ms. Scan: %u ms. Adv events: %u. Conn events: %u.\n", name,
+           (uint32_t) elapsed_ms, (uint32_t) (c->scan_us / 1000U),
+           (uint32_t) c->adv_events, (uint32_t) c->conn_events);
+    printk("[%s] TX: %u packets, %u bytes. RX: %u packets, %u bytes.\n", name,
+           c->tx_packets, (uint32_t) c->tx_bytes, c->rx_packets, (uint32_t) c->rx_bytes);
+    printk("[%s] Radio on: %u.%03u ms (TX %u us, RX %u us). Duty cycle: %u.%03u%%.\n",
+           name, (uint32_t) (on_us / 1000U), (uint32_t) (on_us % 1000U),
+           (uint32_t) c->tx_on_us, (uint32_t) c->rx_on_us, duty_mpc / 1000U,
+           duty_mpc % 1000U);
+    /* No bytes moved: print "-" rather than a misleading 0 uJ/byte. */
+    if (bytes) {
+        snprintk(per_byte, sizeof(per_byte), "%u.%03u", nj_byte / 1000U, nj_byte % 1000U);
+    }
+
+    printk("[%s] Energy: %u.%03u uJ. %s uJ/byte.\n", name, (uint32_t) (nj / 1000U),
+           (uint32_t) (nj % 1000U), per_byte);
+}
+
+void energy_init(uint8_t role)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    memset(&total, 0, sizeof(total));
+    memset(&current, 0, sizeof(current));
+    local_role    = role;
+    boot_ms       = k_uptime_get();
+    checkpoint_ms = boot_ms;
+    link_start_ms = boot_ms;
+    link_end_ms   = boot_ms;
+
+    k_spin_unlock(&lock, key);
+}
+
+void energy_scan_started(const struct bt_le_scan_param *param)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    checkpoint();
+    scanning         = true;
+    scan_interval_us = param->interval * 625U;
+    scan_window_us   = param->window * 625U;
+
+    k_spin_unlock(&lock, key);
+}
+
+void energy_scan_stopped(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    checkpoint();
+    scanning = false;
+
+    k_spin_unlock(&lock, key);
+}
+
+void energy_adv_started(const struct bt_le_adv_param *param, const struct bt_data *ad,
+                        size_t ad_len)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    checkpoint();
+    advertising      = true;
+    adv_remainder_us = 0;
+    adv_interval_us =
+        (param->interval_min + param->interval_max) / 2U * 625U + ADV_DELAY_US;
+
+    /* AdvA followed by every AD structure (length and type bytes included). */
+    adv_pdu_len = sizeof(bt_addr_t);
+    for (size_t i = 0; i < ad_len; i++) {
+        adv_pdu_len += 2U + ad[i].data_len;
+    }
+    if (param->options & BT_LE_ADV_OPT_USE_NAME) {
+        adv_pdu_len += 2U + strlen(bt_get_name());
+    }
+    adv_pdu_len = MIN(adv_pdu_len, sizeof(bt_addr_t) + 31U);
+
+    k_spin_unlock(&lock, key);
+}
+
+void energy_adv_stopped(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    checkpoint();
+    advertising = false;
+
+    k_spin_unlock(&lock, key);
+}
+
+void energy_conn_started(struct bt_conn *conn)
+{
+    struct bt_conn_info info;
+    k_spinlock_key_t key;
+
+    if (bt_conn_get_info(conn, &info)) {
+        return;
+    }
+
+    key = k_spin_lock(&lock);
+
+    checkpoint();
+    memset(&current, 0, sizeof(current));
+    link_start_ms     = checkpoint_ms;
+    connected         = true;
+    conn_remainder_us = 0;
+    conn_interval_us  = info.le.interval * 1250U;
+    conn_latency      = info.le.latency;
+    conn_tx_phy       = BT_GAP_LE_PHY_1M;
+    conn_rx_phy       = BT_GAP_LE_PHY_1M;
+
+    k_spin_unlock(&lock, key);
+}
+
+void energy_conn_param_updated(uint16_t interval, uint16_t latency)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    checkpoint();
+    conn_interval_us = interval * 1250U;
+    conn_latency     = latency;
+
+    k_spin_unlock(&lock, key);
+}
+
+void energy_conn_ended(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    checkpoint();
+    connected   = false;
+    link_end_ms = checkpoint_ms;
+
+    k_spin_unlock(&lock, key);
+}
+
+void energy_set_phy(uint8_t tx_phy, uint8_t rx_phy)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    checkpoint();
+    conn_tx_phy = tx_phy;
+    conn_rx_phy = rx_phy;
+
+    k_spin_unlock(&lock, key);
+}
+
+void energy_tx(size_t len)
+{
+    size_t pdu_len       = len + ENERGY_ATT_OVERHEAD;
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    total.tx_bytes += len;
+    if (connected) {
+        current.tx_bytes += len;
+    }
+
+    /* Each LL fragment is one more packet answered by an empty acknowledgement. */
+    while (pdu_len > 0) {
+        size_t fragment = MIN(pdu_len, ENERGY_LL_PAYLOAD_MAX);
+
+        total.tx_packets++;
+        if (connected) {
+            current.tx_packets++;
+        }
+        add_tx_on(ENERGY_RAMP_UP_US + airtime_us(conn_tx_phy, fragment));
+        add_rx_on(ENERGY_T_IFS_US + airtime_us(conn_rx_phy, 0));
+        pdu_len -= fragment;
+    }
+
+    k_spin_unlock(&lock, key);
+}
+
+void energy_rx(size_t len)
+{
+    size_t pdu_len       = len + ENERGY_ATT_OVERHEAD;
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    total.rx_bytes += len;
+    if (connected) {
+        current.rx_bytes += len;
+    }
+
+    while (pdu_len > 0) {
+        size_t fragment = MIN(pdu_len, ENERGY_LL_PAYLOAD_MAX);
+
+        total.rx_packets++;
+        if (connected) {
+            current.rx_packets++;
+        }
+        add_rx_on(ENERGY_RAMP_UP_US + airtime_us(conn_rx_phy, fragment));
+        add_tx_on(ENERGY_T_IFS_US + airtime_us(conn_tx_phy, 0));
+        pdu_len -= fragment;
+    }
+
+    k_spin_unlock(&lock, key);
+}
+
+void energy_report(void)
+{
+    struct energy_counters total_copy;
+    struct energy_counters link_copy;
+    uint64_t total_ms;
+    uint64_t link_ms;
+    uint8_t tx_phy;
+    uint8_t rx_phy;
+    bool link_up;
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    checkpoint();
+    total_copy = total;
+    link_copy  = current;
+    total_ms   = checkpoint_ms - boot_ms;
+    link_up    = connected;
+    link_ms    = (link_up ? checkpoint_ms : link_end_ms) - link_start_ms;
+    tx_phy     = conn_tx_phy;
+    rx_phy     = conn_rx_phy;
+
+    k_spin_unlock(&lock, key);
+
+    printk("Energy model: TX %u uA, RX %u uA at %u mV. Conn PHY TX 0x%02x, RX 0x%02x.\n",
+           ENERGY_TX_CURRENT_UA, ENERGY_RX_CURRENT_UA, ENERGY_SUPPLY_MV, tx_phy,
+           rx_phy);
+    print_counters(link_up ? "connection" : "last connection", &link_copy, link_ms);
+    print_counters("since boot", &total_copy, total_ms);
+}
@@ -0,0 +1,160 @@
+#ifndef ENERGY_H_
+#define ENERGY_H_
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/conn.h>
+#include <bluetooth/gap.h>
+#include <zephyr.h>
+
+#include "stddef.h"
+#include "stdint.h"
+
+/**
+ * @brief Console command that prints the radio airtime and energy report.
+ *
+ */
+#define ENERGY_REPORT_CMD "stats"
+
+/**
+ * @brief Local device role, used to decide whether slave latency may skip connection
+ * events.
+ *
+ */
+#define ENERGY_ROLE_CENTRAL    0
+#define ENERGY_ROLE_PERIPHERAL 1
+
+/**
+ * @brief Advertising interval of the tuned profile, in units of 0.625 ms (200-250 ms).
+ * Shared with the tuned central, whose scan window spans ENERGY_TUNED_ADV_INT_MAX plus
+ * one advertising event, so the peripheral is heard within one scan interval.
+ *
+ */
+#define ENERGY_TUNED_ADV_INT_MIN 320
+#define ENERGY_TUNED_ADV_INT_MAX 400
+
+/**
+ * @brief Duration of one advertising event on the three channels, in units of 0.625 ms
+ * (10 ms, the maximum random advDelay).
+ *
+ */
+#define ENERGY_ADV_EVENT 16
+
+/**
+ * @brief Supply voltage of the energy model, in mV.
+ *
+ */
+#define ENERGY_SUPPLY_MV 3000U
+
+/**
+ * @brief Radio current while transmitting at 0 dBm (nRF52840, DC/DC on), in uA.
+ *
+ */
+#define ENERGY_TX_CURRENT_UA 4800U
+
+/**
+ * @brief Radio current while receiving (nRF52840, DC/DC on), in uA.
+ *
+ */
+#define ENERGY_RX_CURRENT_UA 4600U
+
+/**
+ * @brief Radio ramp-up time before every TX or RX, in us.
+ *
+ */
+#define ENERGY_RAMP_UP_US 140U
+
+/**
+ * @brief Inter frame space between two packets of the same exchange, in us.
+ *
+ */
+#define ENERGY_T_IFS_US 150U
+
+/**
+ * @brief Maximum Link Layer payload without Data Length Extension, in bytes.
+ *
+ */
+#define ENERGY_LL_PAYLOAD_MAX 27U
+
+/**
+ * @brief L2CAP (4 bytes) plus ATT opcode and handle (3 bytes) added to every GATT
+ * payload.
+ *
+ */
+#define ENERGY_ATT_OVERHEAD 7U
+
+/**
+ * @brief Resets all counters and starts the accounting clock.
+ * @param role ENERGY_ROLE_CENTRAL or ENERGY_ROLE_PERIPHERAL.
+ */
+void energy_init(uint8_t role);
+
+/**
+ * @brief Marks the start of a scan, keeping its interval and window for the duty cycle.
+ * @param param The scan parameters passed to bt_le_scan_start().
+ */
+void energy_scan_started(const struct bt_le_scan_param *param);
+
+/**
+ * @brief Marks the end of the current scan.
+ */
+void energy_scan_stopped(void);
+
+/**
+ * @brief Marks the start of advertising.
+ * @param param The advertising parameters passed to bt_le_adv_start().
+ * @param ad The advertising data.
+ * @param ad_len Number of elements in ad.
+ */
+void energy_adv_started(const struct bt_le_adv_param *param, const struct bt_data *ad,
+                        size_t ad_len);
+
+/**
+ * @brief Marks the end of advertising.
+ */
+void energy_adv_stopped(void);
+
+/**
+ * @brief Starts accounting connection events for a new connection and resets the
+ * per-connection counters.
+ * @param conn The new Bluetooth connection.
+ */
+void energy_conn_started(struct bt_conn *conn);
+
+/**
+ * @brief Updates the connection interval and latency used to count connection events.
+ * @param interval Connection interval, in units of 1.25 ms.
+ * @param latency Slave latency, in connection events.
+ */
+void energy_conn_param_updated(uint16_t interval, uint16_t latency);
+
+/**
+ * @brief Stops accounting connection events for the current connection.
+ */
+void energy_conn_ended(void);
+
+/**
+ * @brief Sets the PHY used to compute the airtime of connection packets.
+ * @param tx_phy The TX PHY (BT_GAP_LE_PHY_1M, BT_GAP_LE_PHY_2M or BT_GAP_LE_PHY_CODED).
+ * @param rx_phy The RX PHY (BT_GAP_LE_PHY_1M, BT_GAP_LE_PHY_2M or BT_GAP_LE_PHY_CODED).
+ */
+void energy_set_phy(uint8_t tx_phy, uint8_t rx_phy);
+
+/**
+ * @brief Accounts a GATT payload sent to the peer.
+ * @param len Length of the payload, in bytes.
+ */
+void energy_tx(size_t len);
+
+/**
+ * @brief Accounts a GATT payload received from the peer.
+ * @param len Length of the payload, in bytes.
+ */
+void energy_rx(size_t len);
+
+/**
+ * @brief Prints scan/advertising time, connection events, packets, bytes, radio-on
+ * time, duty cycle and uJ/byte for the current connection and since boot.
+ */
+void energy_report(void);
+
+#endif /* ENERGY_H_ */
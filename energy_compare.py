@@ -0,0 +1,69 @@
+"""Prints the "stats" reports of the default and tuned profiles side by side.
+
+Included by energy_report.resc once both profiles ran; can also be run with
+`python3 energy_compare.py` from the repository root. Fails when a profile never
+connected, since its report would not be comparable.
+"""
+
+import re
+import sys
+
+SIDES = ("central", "peripheral")
+PROFILES = ("default", "tuned")
+
+METRICS = (
+    ("Time (ms)", r"Time: (\d+) ms"),
+    ("Scan (ms)", r"Scan: (\d+) ms"),
+    ("Adv events", r"Adv events: (\d+)"),
+    ("Conn events", r"Conn events: (\d+)"),
+    ("TX bytes", r"TX: \d+ packets, (\d+) bytes"),
+    ("RX bytes", r"RX: \d+ packets, (\d+) bytes"),
+    ("Radio on (ms)", r"Radio on: ([\d.]+) ms"),
+    ("Duty cycle (%)", r"Duty cycle: ([\d.]+)%"),
+    ("Energy (uJ)", r"Energy: ([\d.]+) uJ\."),
+    ("uJ/byte", r"([\d.]+|-) uJ/byte"),
+)
+
+
+def since_boot(path):
+    """Returns the "[since boot]" lines of the last report in a log."""
+    try:
+        with open(path) as log:
+            lines = [line for line in log if line.startswith("[since boot]")]
+    except IOError:
+        return ""
+    return " ".join(lines[-4:])
+
+
+def connected(path):
+    """Whether the central of a profile run reached the connected state."""
+    try:
+        with open(path) as log:
+            return any("Connected successfully" in line for line in log)
+    except IOError:
+        return False
+
+
+def value(report, pattern):
+    match = re.search(pattern, report)
+    return match.group(1) if match else "-"
+
+
+def main():
+    failed = [
+        profile for profile in PROFILES if not connected("energy_%s_central.log" % profile)
+    ]
+    for profile in failed:
+        print("The %s profile never connected; its report is not comparable." % profile)
+    if failed:
+        sys.exit(1)
+
+    print("%-12s %-16s %14s %14s" % ("Side", "Metric", "default", "tuned"))
+    for side in SIDES:
+        reports = [since_boot("energy_%s_%s.log" % (profile, side)) for profile in PROFILES]
+        for name, pattern in METRICS:
+            print("%-12s %-16s %14s %14s"
+                  % (side, name, value(reports[0], pattern), value(reports[1], pattern)))
+
+
+main()
@@ -5,6 +5,7 @@
 #include <sys/printk.h>
 #include <zephyr.h>
 
+#include "energy.h"
 #include "stdint.h"
 #include "stdlib.h"
 #include "string.h"
@@ -45,6 +46,36 @@
  */
 #define BT_UART_WRITE_CHAR_UUID BT_UUID_DECLARE_16(BT_UART_WRITE_CHAR_UUID_VAL)
 
+/**
+ * @brief Size of each payload buffer: the largest payload plus the string terminator,
+ * rounded up to the slab alignment.
+ *
+ */
+#define PAYLOAD_BUF_SIZE ROUND_UP(CONFIG_APP_PAYLOAD_BUF_SIZE + 1, 4)
+
+/**
+ * @brief Console command that prints the peak stack usage of every thread.
+ *
+ */
+#define STACK_REPORT_CMD "threads"
+
+#if defined(BLE_PARAMS_TUNED)
+/**
+ * @brief Advertising parameters. The tuned profile advertises every 200-250 ms instead
+ * of every 100-150 ms, paired with the scan window of the tuned central.
+ *
+ */
+#define ADV_PARAM                                                                     \
+    BT_LE_ADV_PARAM(BT_LE_ADV_OPT_CONNECTABLE | BT_LE_ADV_OPT_USE_NAME,               \
+                    ENERGY_TUNED_ADV_INT_MIN, ENERGY_TUNED_ADV_INT_MAX, NULL)
+#else
+/**
+ * @brief Advertising parameters.
+ *
+ */
+#define ADV_PARAM BT_LE_ADV_CONN_NAME
+#endif
+
 /**
  * @brief Callback function for when the CCC (Client Characteristic Configuration) value
  * is changed.
@@ -92,6 +123,34 @@ static void connected(struct bt_conn *conn, uint8_t err);
  */
 static void disconnected(struct bt_conn *conn, uint8_t reason);
 
+/**
+ * @brief Callback function for when the connection parameters are updated.
+ * @param conn Pointer to the Bluetooth connection.
+ * @param interval The new connection interval, in units of 1.25 ms.
+ * @param latency The new slave latency.
+ * @param timeout The new supervision timeout, in units of 10 ms.
+ */
+static void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency,
+                             uint16_t timeout);
+
+/**
+ * @brief Callback function for when the PHY of the connection is updated.
+ * @param conn Pointer to the Bluetooth connection.
+ * @param param The new TX and RX PHY.
+ */
+static void le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param);
+
+/**
+ * @brief Task to handle console commands.
+ */
+static void input_task(void);
+
+/**
+ * @brief Starts connectable advertising and accounts it in the energy report.
+ * @return 0 if advertising started, otherwise a negative error code.
+ */
+static int start_advertising(void);
+
 /**
  * @brief Main function of the program.
  * @return 0 if the program was successful, otherwise a negative error code.
@@ -108,10 +167,19 @@ static struct bt_gatt_cb gatt_cb = {
 
 /** @brief Connection callback object. */
 struct bt_conn_cb conn_cb = {
-    .connected    = connected,
-    .disconnected = disconnected,
+    .connected        = connected,
+    .disconnected     = disconnected,
+    .le_param_updated = le_param_updated,
+    .le_phy_updated   = le_phy_updated,
 };
 
+/** @brief Thread object to handle console commands. */
+K_THREAD_DEFINE(input, CONFIG_APP_INPUT_STACK_SIZE, input_task, NULL, NULL, NULL, 1, 0,
+                1000);
+
+/** @brief Static pool of buffers for written GATT payloads. */
+K_MEM_SLAB_DEFINE(payload_slab, PAYLOAD_BUF_SIZE, CONFIG_APP_PAYLOAD_BUF_COUNT, 4);
+
 /** @brief Advertisement data to be broadcasted by the device. */
 static const struct bt_data ad[] = {
     BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
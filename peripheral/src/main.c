@@ -5,6 +5,7 @@
 #include <bluetooth/uuid.h>
 #include <console/console.h>
 #include <ctype.h>
+#include <debug/thread_analyzer.h>
 #include <errno.h>
 #include <kernel.h>
 #include <peripheral.h>
@@ -42,7 +43,19 @@ static int write_uart(struct bt_conn *conn, const struct bt_gatt_attr *attr,
         return -EINVAL;
     }
 
-    char data[len + 1];
+    energy_rx(len);
+
+    if (len > CONFIG_APP_PAYLOAD_BUF_SIZE) {
+        printk("Payload too long: %u bytes.\n", len);
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    char *data;
+    if (k_mem_slab_alloc(&payload_slab, (void **) &data, K_NO_WAIT)) {
+        printk("No payload buffer available.\n");
+        return BT_GATT_ERR(BT_ATT_ERR_INSUFFICIENT_RESOURCES);
+    }
+
     memcpy(data, buf, len);
     data[len] = '\0';
 
@@ -57,11 +70,14 @@ static int write_uart(struct bt_conn *conn, const struct bt_gatt_attr *attr,
     printk("Converted data: %s\n", data);
 
     int err = bt_gatt_notify(NULL, &bt_uart.attrs[1], data, len);
+    k_mem_slab_free(&payload_slab, (void **) &data);
     if (err) {
         printk("Error notifying: %d\n", err);
         return err;
     }
 
+    energy_tx(len);
+
     return 0;
 }
 
@@ -78,6 +94,8 @@ static void connected(struct bt_conn *conn, uint8_t err)
         } else {
             default_conn = bt_conn_ref(conn);
             printk("Peripheral connected.\n");
+            energy_adv_stopped();
+            energy_conn_started(conn);
         }
     }
 }
@@ -86,13 +104,14 @@ static void disconnected(struct bt_conn *conn, uint8_t reason)
 {
     int err = 0;
     printk("Disconnected. Reason: %u.\n", reason);
+    energy_conn_ended();
 
     if (default_conn) {
         bt_conn_unref(default_conn);
         default_conn = NULL;
     }
 
-    err = bt_le_adv_start(BT_LE_ADV_CONN_NAME, ad, ARRAY_SIZE(ad), NULL, 0);
+    err = start_advertising();
     if (err) {
         printk("Failed to start advertising. Error: %d.\n", err);
     } else {
@@ -100,9 +119,66 @@ static void disconnected(struct bt_conn *conn, uint8_t reason)
     }
 }
 
+static void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency,
+                             uint16_t timeout)
+{
+    printk("Connection parameters updated. Interval: %u. Latency: %u. Timeout: %u.\n",
+           interval, latency, timeout);
+
+    if (conn == default_conn) {
+        energy_conn_param_updated(interval, latency);
+    }
+}
+
+static void le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
+{
+    printk("PHY updated. TX: 0x%02x. RX: 0x%02x.\n", param->tx_phy, param->rx_phy);
+
+    if (conn == default_conn) {
+        energy_set_phy(param->tx_phy, param->rx_phy);
+    }
+}
+
+static void input_task(void)
+{
+    char *input = NULL;
+
+    console_getline_init();
+
+    while (true) {
+        input = console_getline();
+
+        if (input == NULL) {
+            printk("Error receiving console input!\n");
+            continue;
+        }
+
+        if (!strcmp(input, ENERGY_REPORT_CMD)) {
+            energy_report();
+        } else if (!strcmp(input, STACK_REPORT_CMD)) {
+            thread_analyzer_print();
+        } else {
+            printk("Unknown command: %s. Available: %s, %s.\n", input, ENERGY_REPORT_CMD,
+                   STACK_REPORT_CMD);
+        }
+    }
+}
+
+static int start_advertising(void)
+{
+    int err = bt_le_adv_start(ADV_PARAM, ad, ARRAY_SIZE(ad), NULL, 0);
+    if (err) {
+        return err;
+    }
+
+    energy_adv_started(ADV_PARAM, ad, ARRAY_SIZE(ad));
+    return 0;
+}
+
 void main(void)
 {
     int err;
+    energy_init(ENERGY_ROLE_PERIPHERAL);
     bt_conn_cb_register(&conn_cb);
     bt_gatt_cb_register(&gatt_cb);
     err = bt_enable(NULL);
@@ -113,7 +189,7 @@ void main(void)
 
     printk("Success: Bluetooth initialized\n");
 
-    err = bt_le_adv_start(BT_LE_ADV_CONN_NAME, ad, ARRAY_SIZE(ad), NULL, 0);
+    err = start_advertising();
     if (err) {
         printk("Fail: Advertising failed to start. Error: %d.\n", err);
         return;
@@ -0,0 +1,151 @@
+"""PlatformIO `footprint` target.
+
+Prints the flash and RAM used by every module (library archive or application object)
+from the linker map and fails when the firmware exceeds CONFIG_APP_FLASH_BUDGET or
+CONFIG_APP_RAM_BUDGET.
+
+    pio run -t footprint
+
+Shared by central and peripheral through `extra_scripts`. test_footprint.py checks the
+parser against a known map.
+"""
+
+import os
+import re
+from collections import defaultdict
+
+RAM_START = 0x20000000
+
+OUTPUT_SECTION = re.compile(
+    r"^([._a-zA-Z/]\S*)?\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)(?:\s+load address 0x([0-9a-f]+))?$"
+)
+INPUT_SECTION = re.compile(r"^\s+(\S+)?\s*0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S.*)$")
+
+# Output sections without SHF_ALLOC: they are linked at address 0 but never loaded.
+NON_ALLOC_SECTION = re.compile(
+    r"^(\.debug|\.stab|\.comment$|\.ARM\.attributes$|\.gnu\.attributes$|\.note\.GNU-stack$"
+    r"|\.symtab$|\.strtab$|\.shstrtab$|/DISCARD/$)"
+)
+
+
+def module_name(path, build_dir=""):
+    """Maps `libsubsys__bluetooth__host.a(hci_core.c.obj)` to `subsys/bluetooth/host`
+    and `src/main.o` to `src/main`."""
+    archive = re.match(r"(.*)\(.*\)$", path)
+    if archive:
+        name = os.path.basename(archive.group(1))
+        name = re.sub(r"^lib|\.a$", "", name)
+        return name.replace("__", "/")
+    name = os.path.relpath(path, build_dir) if build_dir and os.path.isabs(path) else path
+    return re.sub(r"(\.c|\.S)?\.o(bj)?$", "", name)
+
+
+def parse_map(path, build_dir=""):
+    """Returns {module: [flash, ram]} in bytes."""
+    usage = defaultdict(lambda: [0, 0])
+    in_flash = in_ram = False
+    pending = pending_output = None
+
+    with open(path) as map_file:
+        lines = iter(map_file)
+        for line in lines:
+            if line.startswith("Linker script and memory map"):
+                break
+
+        for line in lines:
+            line = line.rstrip()
+            if not line or line.startswith("OUTPUT("):
+                continue
+
+            # Output sections start at column 0; long names are wrapped onto their own line.
+            match = OUTPUT_SECTION.match(line)
+            if match and (match.group(1) or pending_output):
+                name = match.group(1) or pending_output
+                address = int(match.group(2), 16)
+                load = match.group(4)
+                if NON_ALLOC_SECTION.match(name):
+                    in_flash = in_ram = False
+                else:
+                    in_ram = address >= RAM_START
+                    in_flash = not in_ram or (load is not None and int(load, 16) < RAM_START)
+                pending = pending_output = None
+                continue
+
+            if not line[0].isspace():
+                pending = None
+                pending_output = line if re.match(r"^[._a-zA-Z/]\S*$", line) else None
+                continue
+            pending_output = None
+
+            match = INPUT_SECTION.match(line)
+            if not match:
+                # Long input section names are wrapped onto their own line.
+                pending = line.strip() if line.startswith(" .") else None
+                continue
+
+            name = match.group(1) or pending
+            pending = None
+            size = int(match.group(3), 16)
+            if not name or name == "*fill*" or not size or not (in_flash or in_ram):
+                continue
+
+            module = usage[module_name(match.group(4), build_dir)]
+            if in_flash:
+                module[0] += size
+            if in_ram:
+                module[1] += size
+
+    return usage
+
+
+def read_budget(config, name):
+    with open(config) as config_file:
+        for line in config_file:
+            if line.startswith(name + "="):
+                return int(line.split("=", 1)[1], 0)
+    return 0
+
+
+def footprint(target, source, env):
+    build_dir = env.subst("$BUILD_DIR")
+    config = os.path.join(build_dir, "zephyr", ".config")
+    usage = parse_map(os.path.join(build_dir, "firmware.map"), build_dir)
+    flash = sum(module[0] for module in usage.values())
+    ram = sum(module[1] for module in usage.values())
+
+    print("%-48s %10s %10s" % ("Module", "Flash", "RAM"))
+    for name, (module_flash, module_ram) in sorted(
+        usage.items(), key=lambda item: (item[1][0] + item[1][1]), reverse=True
+    ):
+        print("%-48s %10d %10d" % (name, module_flash, module_ram))
+    print("%-48s %10d %10d" % ("Total", flash, ram))
+
+    failed = False
+    for kind, used, budget in (
+        ("Flash", flash, read_budget(config, "CONFIG_APP_FLASH_BUDGET")),
+        ("RAM", ram, read_budget(config, "CONFIG_APP_RAM_BUDGET")),
+    ):
+        if budget and used > budget:
+            print("%s budget exceeded: %d of %d bytes." % (kind, used, budget))
+            failed = True
+        elif budget:
+            print("%s: %d of %d bytes (%d%%)." % (kind, used, budget, used * 100 // budget))
+
+    return 1 if failed else 0
+
+
+try:
+    # Only defined when PlatformIO runs this file as an extra script.
+    Import("env")
+except NameError:
+    env = None
+
+if env is not None:
+    env.Append(LINKFLAGS=["-Wl,-Map=" + os.path.join(env.subst("$BUILD_DIR"), "firmware.map")])
+    env.AddCustomTarget(
+        name="footprint",
+        dependencies="$BUILD_DIR/${PROGNAME}.elf",
+        actions=footprint,
+        title="Footprint",
+        description="Print flash/RAM per module and check the Kconfig budgets",
+    )
@@ -0,0 +1,33 @@
+"""Checks footprint.py against test_footprint.map.
+
+    python3 scripts/test_footprint.py
+"""
+
+import os
+import unittest
+
+from footprint import parse_map
+
+MAP = os.path.join(os.path.dirname(os.path.abspath(__file__)), "test_footprint.map")
+
+
+class ParseMapTest(unittest.TestCase):
+    def setUp(self):
+        self.usage = parse_map(MAP)
+
+    def test_modules(self):
+        self.assertEqual(self.usage["src/main"], [0x80 + 0x30, 0])
+        self.assertEqual(self.usage["lib/energy/energy"], [0x100 + 0x20, 0x20 + 0x100])
+        self.assertEqual(self.usage["subsys/bluetooth/host"], [0x200, 0x300])
+        self.assertEqual(self.usage["arch/arm/core/aarch32"], [0x40, 0])
+        self.assertEqual(self.usage["kernel"], [0, 0x200])
+
+    def test_non_alloc_sections_are_ignored(self):
+        flash = sum(module[0] for module in self.usage.values())
+        ram = sum(module[1] for module in self.usage.values())
+        self.assertEqual(flash, 0x40 + 0x80 + 0x100 + 0x200 + 0x30 + 0x20)
+        self.assertEqual(ram, 0x20 + 0x100 + 0x300 + 0x200)
+
+
+if __name__ == "__main__":
+    unittest.main()